@@ -0,0 +1,138 @@
+#ifndef BLOCK_HASH_HPP_
+#define BLOCK_HASH_HPP_
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <utility>
+#include <algorithm>
+#include <string.h>
+
+struct BlockHash {
+    uint64_t h1;
+    uint64_t h2;
+
+    bool operator==(const BlockHash& o) const {
+        return h1 == o.h1 && h2 == o.h2;
+    }
+
+    bool operator!=(const BlockHash& o) const {
+        return !(*this == o);
+    }
+};
+
+using Range = std::pair<uint64_t, uint64_t>;
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64_128 style mixing, 16 bytes per round
+static BlockHash hash_block(const char *buf, size_t size) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = size;
+    uint64_t h2 = size;
+
+    auto mix = [&](uint64_t k1, uint64_t k2) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1*5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2*5 + 0x38495ab5;
+    };
+
+    size_t i = 0;
+    for(; i + 16 <= size; i += 16) {
+        uint64_t k[2];
+        memcpy(k, buf + i, 16);
+        mix(k[0], k[1]);
+    }
+    if(i < size) {
+        uint64_t k[2] = {0, 0};
+        memcpy(k, buf + i, size - i);
+        mix(k[0], k[1]);
+    }
+
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    return BlockHash{h1, h2};
+}
+
+static uint64_t num_blocks(uint64_t size, uint64_t block_size) {
+    return (size + block_size - 1) / block_size;
+}
+
+static std::vector<BlockHash> hash_blocks(const char *buf, uint64_t size,
+    uint64_t block_size, unsigned num_threads=std::thread::hardware_concurrency()) {
+    std::vector<BlockHash> hashes(num_blocks(size, block_size));
+    num_threads = std::max(1u, std::min<unsigned>(num_threads, hashes.size()));
+
+    std::atomic<uint64_t> next(0);
+    auto worker = [&]{
+        uint64_t i;
+        while((i = next++) < hashes.size()) {
+            uint64_t offset = i * block_size;
+            hashes[i] = hash_block(buf + offset, std::min(block_size, size - offset));
+        }
+    };
+    std::vector<std::thread> threads;
+    for(unsigned i=1; i<num_threads; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for(auto& t: threads) {
+        t.join();
+    }
+    return hashes;
+}
+
+// merges adjacent mismatched blocks into (offset, length) ranges
+static std::vector<Range> diff_blocks(const std::vector<BlockHash>& local,
+    const std::vector<BlockHash>& remote, uint64_t size, uint64_t block_size) {
+    std::vector<Range> ranges;
+    for(uint64_t i=0; i<remote.size(); ++i) {
+        if(i < local.size() && local[i] == remote[i]) {
+            continue;
+        }
+        uint64_t offset = i * block_size;
+        uint64_t length = std::min(block_size, size - offset);
+        if(!ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+            ranges.back().second += length;
+        }
+        else {
+            ranges.emplace_back(offset, length);
+        }
+    }
+    return ranges;
+}
+
+// the parts of [0, size) not covered by sorted, disjoint ranges
+static std::vector<Range> complement_ranges(const std::vector<Range>& ranges, uint64_t size) {
+    std::vector<Range> res;
+    uint64_t offset = 0;
+    for(auto& range: ranges) {
+        if(range.first > offset) {
+            res.emplace_back(offset, range.first - offset);
+        }
+        offset = range.first + range.second;
+    }
+    if(offset < size) {
+        res.emplace_back(offset, size - offset);
+    }
+    return res;
+}
+
+#endif
@@ -1,6 +1,10 @@
 #include <iostream>
+#include <deque>
+#include <condition_variable>
+#include <csignal>
 #include <ib++/conn.hpp>
 #include "file_request.hpp"
+#include "block_hash.hpp"
 
 using namespace std;
 
@@ -21,12 +25,260 @@ FileResponse request_file(const FileRequest& req, ib::Conn<>& conn) {
     return res;
 }
 
+static const size_t kMaxInflightReads = 8;
+// how long downstreams may take to connect once the local transfer is done
+static const chrono::seconds kDownstreamGrace(30);
+
+// ranges of the destination that hold final data, for re-serving downstream
+class ChunkLog {
+public:
+    void Append(const Range& range) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        landed_.push_back(range);
+        cv_.notify_all();
+    }
+
+    void Close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        closed_at_ = chrono::steady_clock::now();
+        cv_.notify_all();
+    }
+
+    bool ClosedLongerThan(chrono::steady_clock::duration d) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return closed_ && chrono::steady_clock::now() - closed_at_ > d;
+    }
+
+    bool Get(size_t i, Range *range) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]{ return i < landed_.size() || closed_; });
+        if(i >= landed_.size()) {
+            return false;
+        }
+        *range = landed_[i];
+        return true;
+    }
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    vector<Range> landed_;
+    bool closed_ = false;
+    chrono::steady_clock::time_point closed_at_;
+};
+
+// posts reads with a bounded number in flight, a reaper thread handles each
+// read as soon as it completes so landed chunks are logged and acked eagerly
+class Fetcher {
+public:
+    Fetcher(ib::Conn<>& conn, ib::MrPtr mr, uint64_t chunk_size, ChunkLog& log):
+        conn_(conn), mr_(mr), chunk_size_(chunk_size), log_(log),
+        reaper_([this]{ reap(); }) {}
+
+    Fetcher(const Fetcher&) = delete;
+
+    ~Fetcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        reaper_.join();
+    }
+
+    // with ack set, FileChunkDone{offset} is sent once the whole length has landed
+    void Fetch(uint64_t offset, uint64_t length, uint64_t remote_addr, uint32_t remote_key,
+            bool ack=false) {
+        for(uint64_t done = 0; done < length; done += chunk_size_) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [&]{ return inflight_.size() < kMaxInflightReads || error_; });
+            if(error_) {
+                std::rethrow_exception(error_);
+            }
+            uint64_t n = min(chunk_size_, length - done);
+            inflight_.emplace_back(Range(offset + done, n),
+                conn_.Read(mr_, offset + done, remote_addr + done, remote_key, n),
+                ack && done + n == length, offset);
+            cv_.notify_all();
+        }
+    }
+
+    void Finish() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [&]{ return inflight_.empty() || error_; });
+        if(error_) {
+            std::rethrow_exception(error_);
+        }
+    }
+
+private:
+    struct Inflight {
+        Inflight(Range range_in, future<bool>&& future_in, bool ack_in, uint64_t ack_offset_in):
+            range(range_in), future(std::move(future_in)), ack(ack_in),
+            ack_offset(ack_offset_in) {}
+
+        Range range;
+        std::future<bool> future;
+        bool ack;
+        uint64_t ack_offset;
+    };
+
+    void reap() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(true) {
+            cv_.wait(lock, [&]{ return !inflight_.empty() || stopping_; });
+            if(inflight_.empty()) {
+                return;
+            }
+            // references into a deque survive push_back, only this thread pops
+            auto& oldest = inflight_.front();
+            lock.unlock();
+            try {
+                if(!oldest.future.get()) {
+                    throw std::runtime_error("read remote file failed");
+                }
+                log_.Append(oldest.range);
+                if(oldest.ack && !conn_.cm_conn.PutMsg(FileChunkDone{oldest.ack_offset})) {
+                    throw std::runtime_error("cannot acknowledge file chunk");
+                }
+            }
+            catch(...) {
+                lock.lock();
+                error_ = std::current_exception();
+                cv_.notify_all();
+                return;
+            }
+            lock.lock();
+            inflight_.pop_front();
+            cv_.notify_all();
+        }
+    }
+
+    ib::Conn<>& conn_;
+    ib::MrPtr mr_;
+    uint64_t chunk_size_;
+    ChunkLog& log_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    deque<Inflight> inflight_;
+    std::exception_ptr error_;
+    bool stopping_ = false;
+    std::thread reaper_;
+};
+
+// serves the whole destination, whatever range the downstream asked for
+void serve_downstream(ib::Conn<>& conn, ib::MrPtr file_mr, ChunkLog& log) {
+    while(!conn.WaitConnected(chrono::seconds(1))) {
+        if(log.ClosedLongerThan(kDownstreamGrace)) {
+            cout << "no downstream connected @ " << conn.connect_str << endl;
+            return;
+        }
+    }
+    FileRequest req;
+    if(!conn.cm_conn.GetMsg(&req)) {
+        throw std::runtime_error("cannot get downstream file request");
+    }
+
+    // downstreams only ever read the destination
+    auto mr = ib::make_alias_mr(conn.pd, file_mr, IBV_ACCESS_REMOTE_READ);
+    FileResponse res;
+    res.addr = reinterpret_cast<uint64_t>(mr->addr);
+    res.key = mr->rkey;
+    res.size = mr->length;
+    res.block_size = 0;
+    res.streamed = 1;
+    if(!conn.cm_conn.PutMsg(res)) {
+        throw std::runtime_error("cannot send downstream file response");
+    }
+
+    // acks are read as they come, left unread they would fill the socket and
+    // stall the downstream's reads of further chunks. the mapping stays valid,
+    // so they only need draining
+    mutex ack_mutex;
+    condition_variable ack_cv;
+    size_t num_chunks = 0;
+    bool all_sent = false;
+    exception_ptr ack_error;
+    thread ack_thread([&]{
+        try {
+            for(size_t acked=0;; ++acked) {
+                {
+                    unique_lock<mutex> lock(ack_mutex);
+                    ack_cv.wait(lock, [&]{ return acked < num_chunks || all_sent; });
+                    if(acked == num_chunks) {
+                        return;
+                    }
+                }
+                FileChunkDone ack;
+                if(!conn.cm_conn.GetMsg(&ack)) {
+                    throw std::runtime_error("cannot get downstream chunk ack");
+                }
+            }
+        }
+        catch(...) {
+            lock_guard<mutex> lock(ack_mutex);
+            ack_error = current_exception();
+        }
+    });
+    auto join_acks = [&]{
+        {
+            lock_guard<mutex> lock(ack_mutex);
+            all_sent = true;
+        }
+        ack_cv.notify_all();
+        ack_thread.join();
+    };
+
+    try {
+        Range range;
+        for(size_t i=0; log.Get(i, &range); ++i) {
+            FileChunk chunk{range.first, res.addr + range.first, range.second, res.key};
+            if(!conn.cm_conn.PutMsg(chunk)) {
+                throw std::runtime_error("cannot send downstream file chunk");
+            }
+            lock_guard<mutex> lock(ack_mutex);
+            if(ack_error) {
+                rethrow_exception(ack_error);
+            }
+            ++num_chunks;
+            ack_cv.notify_all();
+        }
+        if(!conn.cm_conn.PutMsg(FileChunk{0, 0, 0, 0})) {
+            throw std::runtime_error("cannot send downstream file chunk");
+        }
+    }
+    catch(...) {
+        // unblocks the ack thread if it waits for an ack that will not come
+        conn.cm_conn.Shutdown();
+        join_acks();
+        throw;
+    }
+    join_acks();
+    if(ack_error) {
+        rethrow_exception(ack_error);
+    }
+
+    FileDone done;
+    if(!conn.cm_conn.GetMsg(&done)) {
+        cout << "downstream @ " << conn.connect_str << " transfer error" << endl;
+    }
+    else {
+        cout << "downstream @ " << conn.connect_str << " transfer success" << endl;
+    }
+}
+
 int main(int argc, char* argv[]) {
     int device = 0;
     int ib_port = 0;
     int pkey_index = 0;
+    uint64_t block_size = 0;
+    uint64_t chunk_size = 64 << 20;
+    vector<string> downstream_ports;
+    uint64_t offset = 0;
+    uint64_t length = 0;
     int c;
-    while((c = getopt(argc, argv, "d:p:k:")) != -1) {
+    while((c = getopt(argc, argv, "d:p:k:b:c:l:o:n:")) != -1) {
         switch(c) {
         case 'd':
         {
@@ -49,6 +301,39 @@ int main(int argc, char* argv[]) {
             cout << "ib port: " << ib_port << endl;
             break;
         }
+        case 'b':
+        {
+            istringstream iss(optarg);
+            iss >> block_size;
+            cout << "resume block size: " << block_size << endl;
+            break;
+        }
+        case 'c':
+        {
+            istringstream iss(optarg);
+            iss >> chunk_size;
+            cout << "chunk size: " << chunk_size << endl;
+            break;
+        }
+        case 'l':
+        {
+            downstream_ports.push_back(optarg);
+            break;
+        }
+        case 'o':
+        {
+            istringstream iss(optarg);
+            iss >> offset;
+            cout << "offset: " << offset << endl;
+            break;
+        }
+        case 'n':
+        {
+            istringstream iss(optarg);
+            iss >> length;
+            cout << "length: " << length << endl;
+            break;
+        }
         case '?':
             return 1;
         default:
@@ -60,6 +345,16 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    // a vanished downstream must surface as a write error, not kill the node
+    signal(SIGPIPE, SIG_IGN);
+
+    vector<unique_ptr<ib::Conn<>>> downstreams;
+    for(auto& port: downstream_ports) {
+        downstreams.emplace_back(new ib::Conn<>(ib::LISTENER, "0.0.0.0:"+port,
+            device, ib_port, pkey_index));
+        cout << "serving downstream @ " << downstreams.back()->connect_str << endl;
+    }
+
     ib::Conn<> conn(ib::CONNECTOR, argv[optind], device, ib_port, pkey_index);
     cout << "waiting for connection to be established" << endl;
     conn.WaitConnected();
@@ -67,21 +362,92 @@ int main(int argc, char* argv[]) {
     FileRequest req;
     strncpy(req.filepath, argv[optind+1], 1023);
     req.filepath[1023] = '\0';
+    req.block_size = block_size;
+    req.offset = offset;
+    req.length = length;
     auto remote_info = request_file(req, conn);
     cout << "raddr: " << remote_info.addr << ", rkey: " << remote_info.key
         << ", size: " << remote_info.size << endl;
 
-    auto mr_ptr = ib::make_file_mr(conn.pd, argv[optind+2], remote_info.size);
+    // a range lands at its own offset, streamed responses always cover the
+    // whole file and carry absolute offsets
+    uint64_t base = remote_info.streamed ? 0 : offset;
+    uint64_t local_size = base + remote_info.size;
+    if(offset || length) {
+        // never shrink a local copy a range is patched into
+        struct stat st;
+        if(0 == stat(argv[optind+2], &st)) {
+            local_size = max<uint64_t>(local_size, st.st_size);
+        }
+    }
+    auto mr_ptr = ib::make_file_mr(conn.pd, argv[optind+2], local_size);
+
+    ChunkLog log;
+    vector<thread> forwarders;
+    for(auto& downstream: downstreams) {
+        auto downstream_ptr = downstream.get();
+        forwarders.emplace_back([downstream_ptr, mr_ptr, &log]{
+            // a failing downstream must not take this node and its upstream down
+            try {
+                serve_downstream(*downstream_ptr, mr_ptr, log);
+            }
+            catch(const std::exception& e) {
+                cout << "downstream @ " << downstream_ptr->connect_str << " error: "
+                    << e.what() << endl;
+            }
+        });
+    }
+
+    vector<Range> ranges{Range(0, remote_info.size)};
+    if(remote_info.block_size) {
+        auto local_hashes = hash_blocks(reinterpret_cast<const char*>(mr_ptr->addr) + base,
+            remote_info.size, remote_info.block_size);
+        vector<BlockHash> remote_hashes(local_hashes.size());
+        if(!conn.cm_conn.GetMsgs(remote_hashes.data(), remote_hashes.size())) {
+            throw std::runtime_error("cannot get block hashes");
+        }
+        ranges = diff_blocks(local_hashes, remote_hashes, remote_info.size,
+            remote_info.block_size);
+        uint64_t fetch_size = 0;
+        for(auto& range: ranges) {
+            fetch_size += range.second;
+        }
+        cout << "fetching " << fetch_size << " bytes in " << ranges.size()
+            << " ranges" << endl;
+        for(auto& range: complement_ranges(ranges, remote_info.size)) {
+            log.Append(Range(base + range.first, range.second));
+        }
+    }
 
     auto start_tp = chrono::system_clock::now();
-    auto future = conn.Read(mr_ptr, remote_info.addr, remote_info.key, remote_info.size);
-    bool success = future.get();
-    auto time_elapsed = chrono::system_clock::now() - start_tp;
-    if(!success) {
-        throw std::runtime_error("read remote file failed");
+    Fetcher fetcher(conn, mr_ptr, chunk_size, log);
+    if(remote_info.streamed) {
+        FileChunk chunk;
+        while(true) {
+            if(!conn.cm_conn.GetMsg(&chunk)) {
+                throw std::runtime_error("cannot get file chunk");
+            }
+            if(!chunk.size) {
+                break;
+            }
+            fetcher.Fetch(chunk.offset, chunk.size, chunk.addr, chunk.key, true);
+        }
     }
+    else {
+        for(auto& range: ranges) {
+            fetcher.Fetch(base + range.first, range.second, remote_info.addr + range.first,
+                remote_info.key);
+        }
+    }
+    fetcher.Finish();
+    log.Close();
+    auto time_elapsed = chrono::system_clock::now() - start_tp;
     cout << "read time: " <<
         chrono::duration_cast<chrono::microseconds>(time_elapsed).count() << "us" << endl;
 
     conn.cm_conn.PutMsg(FileDone{});
+
+    for(auto& forwarder: forwarders) {
+        forwarder.join();
+    }
 }
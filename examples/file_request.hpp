@@ -3,12 +3,34 @@
 
 struct FileRequest {
     char filepath[1024];
+    // non-zero asks the server to follow the response with per-block hashes
+    uint64_t block_size;
+    // range of the file to transfer, length 0 means up to the end of file
+    uint64_t offset;
+    uint64_t length;
 };
 
 struct FileResponse {
     uint64_t addr;
     uint64_t size;
     uint32_t key;
+    // non-zero if num_blocks(size, block_size) BlockHash follow
+    uint64_t block_size;
+    // non-zero if the data is advertised piecewise by FileChunk messages
+    uint32_t streamed;
+};
+
+// a piece of the file that is ready to be read, size 0 ends the stream
+struct FileChunk {
+    uint64_t offset;
+    uint64_t addr;
+    uint64_t size;
+    uint32_t key;
+};
+
+// acknowledges that the chunk at offset has been read and its buffer may be reused
+struct FileChunkDone {
+    uint64_t offset;
 };
 
 struct FileDone {
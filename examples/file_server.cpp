@@ -1,7 +1,12 @@
 #include <iostream>
 #include <ib++/conn.hpp>
 #include <sstream>
+#include <map>
+#include <csignal>
+#include <condition_variable>
 #include "file_request.hpp"
+#include "block_hash.hpp"
+#include "uring.hpp"
 
 using namespace std;
 
@@ -11,14 +16,301 @@ enum ConnState {
     ERROR,
 };
 
+static const size_t kDirectIoAlign = 4096;
+
+// resolves the requested range against the file, length 0 means up to the end
+void request_range(const FileRequest& req, uint64_t file_size, uint64_t *offset,
+    uint64_t *length) {
+    if(req.offset > file_size) {
+        throw std::out_of_range("requested range exceeds file");
+    }
+    *offset = req.offset;
+    *length = req.length ? req.length : file_size - req.offset;
+    if(*length > file_size - *offset) {
+        throw std::out_of_range("requested range exceeds file");
+    }
+}
+
+void send_response(ib::Conn<>& conn, const FileRequest& req, const char *addr,
+    uint64_t size, uint32_t key) {
+    FileResponse res;
+    res.addr = reinterpret_cast<uint64_t>(addr);
+    res.key = key;
+    res.size = size;
+    res.block_size = req.block_size;
+    res.streamed = 0;
+    if(!conn.cm_conn.PutMsg(res)) {
+        throw std::runtime_error("cannot send file response");
+    }
+
+    if(res.block_size) {
+        auto hashes = hash_blocks(addr, size, res.block_size);
+        if(!conn.cm_conn.PutMsgs(hashes.data(), hashes.size())) {
+            throw std::runtime_error("cannot send block hashes");
+        }
+    }
+}
+
+void wait_done(ib::Conn<>& conn) {
+    FileDone done;
+    if(!conn.cm_conn.GetMsg(&done)) {
+        cout << "file transfer error" << endl;
+    }
+    else {
+        cout << "file transfer success" << endl;
+    }
+}
+
+// one registration per file shared by all clients, redone when the file changes,
+// clients still holding the previous one keep it alive until they are done
+class FileRegistry {
+public:
+    FileRegistry(ib::PdPtr pd): pd_(pd) {}
+
+    ib::MrPtr Get(const string& path) {
+        struct stat st;
+        if(-1 == stat(path.c_str(), &st)) {
+            throw std::runtime_error("cannot get file stat");
+        }
+        lock_guard<mutex> lock(mutex_);
+        auto& entry = files_[path];
+        if(!entry.mr || entry.size != st.st_size ||
+                entry.mtime.tv_sec != st.st_mtim.tv_sec ||
+                entry.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+            entry.mr = ib::make_file_mr(pd_, path.c_str(), -1,
+                IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND);
+            entry.size = st.st_size;
+            entry.mtime = st.st_mtim;
+        }
+        return entry.mr;
+    }
+
+private:
+    struct Entry {
+        ib::MrPtr mr;
+        off_t size;
+        timespec mtime;
+    };
+
+    ib::PdPtr pd_;
+    mutex mutex_;
+    map<string, Entry> files_;
+};
+
+// every request only gets a memory window over its range, revoked on FileDone
+void serve_window_client(ib::Conn<>& conn, FileRegistry& registry, ib::PdPtr pd) {
+    try {
+        FileRequest req;
+        if(!conn.cm_conn.GetMsg(&req)) {
+            throw std::runtime_error("cannot get file request");
+        }
+        cout << "request file: " << req.filepath << endl;
+
+        auto file_mr = registry.Get(req.filepath);
+        uint64_t offset, length;
+        request_range(req, file_mr->length, &offset, &length);
+
+        auto mw = ib::make_mw(pd);
+        if(!conn.BindMw(mw, file_mr, offset, length).get()) {
+            throw std::runtime_error("cannot bind mw");
+        }
+        send_response(conn, req, reinterpret_cast<const char*>(file_mr->addr) + offset,
+            length, mw->rkey);
+        wait_done(conn);
+        if(!conn.InvalidateMw(mw).get()) {
+            throw std::runtime_error("cannot invalidate mw");
+        }
+    }
+    catch(const std::exception& e) {
+        cout << "client error: " << e.what() << endl;
+    }
+}
+
+static const chrono::seconds kHandshakeTimeout(30);
+
+// accepts clients on one port and serves each on its own thread, all of them
+// sharing the pd and the file registrations
+void serve_windows(string connect_str, int device, int ib_port, int pkey_index) {
+    signal(SIGPIPE, SIG_IGN);
+    auto pd = ib::make_pd(ib::make_ctx(ib::get_devices(), device));
+    FileRegistry registry(pd);
+    while(true) {
+        auto conn = make_shared<ib::Conn<>>(ib::LISTENER, connect_str, pd, ib_port, pkey_index);
+        // stay on the port picked for the first listener
+        connect_str = "0.0.0.0:" + conn->connect_str.substr(conn->connect_str.rfind(":") + 1);
+        cout << "waiting for connection @ " << conn->connect_str << endl;
+        try {
+            conn->WaitPeer();
+        }
+        catch(const std::exception& e) {
+            cout << "client error: " << e.what() << endl;
+            continue;
+        }
+        // the handshake runs on the client's thread, so the next listener is
+        // up as soon as this one has accepted
+        thread([conn, &registry, pd]{
+            try {
+                if(!conn->WaitConnected(kHandshakeTimeout)) {
+                    cout << "client handshake timed out" << endl;
+                    return;
+                }
+            }
+            catch(const std::exception& e) {
+                cout << "client error: " << e.what() << endl;
+                return;
+            }
+            serve_window_client(*conn, registry, pd);
+        }).detach();
+    }
+}
+
+// the io_uring part of serve_staged, fd stays owned by the caller
+void stream_chunks(ib::Conn<>& conn, int fd, uint64_t chunk_size, unsigned depth) {
+    struct stat st;
+    if(-1 == fstat(fd, &st)) {
+        throw std::runtime_error("cannot get file stat");
+    }
+    uint64_t size = st.st_size;
+    uint64_t num_chunks = (size + chunk_size - 1) / chunk_size;
+
+    auto staging_mr = ib::make_aligned_mr(conn.pd, chunk_size*depth, kDirectIoAlign);
+    auto staging = reinterpret_cast<char*>(staging_mr->addr);
+    FileResponse res;
+    res.addr = reinterpret_cast<uint64_t>(staging);
+    res.key = staging_mr->rkey;
+    res.size = size;
+    res.block_size = 0;
+    res.streamed = 1;
+    if(!conn.cm_conn.PutMsg(res)) {
+        throw std::runtime_error("cannot send file response");
+    }
+
+    Uring ring(depth);
+    mutex ring_mutex;
+    condition_variable ring_cv;
+    uint64_t next_chunk = 0;
+    vector<unsigned> chunk_slots(num_chunks);
+    exception_ptr ack_error;
+    auto submit = [&](unsigned slot) {
+        lock_guard<mutex> lock(ring_mutex);
+        if(next_chunk == num_chunks) {
+            return;
+        }
+        uint64_t chunk = next_chunk++;
+        chunk_slots[chunk] = slot;
+        uint64_t offset = chunk*chunk_size;
+        uint64_t length = min(chunk_size, size - offset);
+        length = (length + kDirectIoAlign - 1) / kDirectIoAlign * kDirectIoAlign;
+        ring.PrepRead(fd, staging + slot*chunk_size, length, offset, chunk);
+        ring.Submit();
+        ring_cv.notify_all();
+    };
+    for(unsigned slot=0; slot<depth; ++slot) {
+        submit(slot);
+    }
+
+    thread ack_thread([&]{
+        try {
+            for(uint64_t i=0; i<num_chunks; ++i) {
+                FileChunkDone ack;
+                if(!conn.cm_conn.GetMsg(&ack)) {
+                    throw std::runtime_error("cannot get chunk ack");
+                }
+                if(ack.offset / chunk_size >= num_chunks) {
+                    throw std::out_of_range("chunk ack exceeds file");
+                }
+                unsigned slot;
+                {
+                    lock_guard<mutex> lock(ring_mutex);
+                    slot = chunk_slots[ack.offset / chunk_size];
+                }
+                submit(slot);
+            }
+        }
+        catch(...) {
+            lock_guard<mutex> lock(ring_mutex);
+            ack_error = current_exception();
+            ring_cv.notify_all();
+        }
+    });
+
+    try {
+        for(uint64_t i=0; i<num_chunks; ++i) {
+            {
+                // a failed ack thread submits nothing more, so only wait on the
+                // ring while a read is in flight
+                unique_lock<mutex> lock(ring_mutex);
+                ring_cv.wait(lock, [&]{ return i < next_chunk || ack_error; });
+                if(ack_error) {
+                    rethrow_exception(ack_error);
+                }
+            }
+            auto cqe = ring.Wait();
+            uint64_t offset = cqe.user_data*chunk_size;
+            uint64_t length = min(chunk_size, size - offset);
+            if(cqe.res < 0 || static_cast<uint64_t>(cqe.res) < length) {
+                throw std::runtime_error("cannot read file chunk");
+            }
+            unsigned slot;
+            {
+                lock_guard<mutex> lock(ring_mutex);
+                slot = chunk_slots[cqe.user_data];
+            }
+            FileChunk chunk{offset, res.addr + slot*chunk_size, length, res.key};
+            if(!conn.cm_conn.PutMsg(chunk)) {
+                throw std::runtime_error("cannot send file chunk");
+            }
+        }
+        if(!conn.cm_conn.PutMsg(FileChunk{0, 0, 0, 0})) {
+            throw std::runtime_error("cannot send file chunk");
+        }
+    }
+    catch(...) {
+        // unblocks the ack thread, the client is given up anyway
+        conn.cm_conn.Shutdown();
+        ack_thread.join();
+        throw;
+    }
+    ack_thread.join();
+    if(ack_error) {
+        rethrow_exception(ack_error);
+    }
+}
+
+// reads the file with io_uring into registered staging buffers and advertises
+// each chunk as soon as it is ready, buffers are reused once the client acks
+void serve_staged(ib::Conn<>& conn, const char *filepath, uint64_t chunk_size,
+    unsigned depth) {
+    int fd = open(filepath, O_RDONLY | O_DIRECT);
+    if(fd == -1 && errno == EINVAL) {
+        cout << "O_DIRECT not supported, staging through page cache" << endl;
+        fd = open(filepath, O_RDONLY);
+    }
+    if(fd == -1) {
+        throw std::runtime_error("cannot open file");
+    }
+    try {
+        stream_chunks(conn, fd, chunk_size, depth);
+    }
+    catch(...) {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
 int main(int argc, char *argv[]) {
     int device = 0;
     int ib_port = 0;
     int tcp_port = 0;
     int pkey_index = 0;
     string connect_str = "0.0.0.0:0";
+    bool staged = false;
+    uint64_t chunk_size = 4 << 20;
+    unsigned depth = 16;
+    bool windows = false;
     int c;
-    while((c = getopt(argc, argv, "d:p:k:l:")) != -1) {
+    while((c = getopt(argc, argv, "d:p:k:l:sc:q:w")) != -1) {
         switch(c) {
         case 'd':
         {
@@ -46,6 +338,41 @@ int main(int argc, char *argv[]) {
             connect_str = string("0.0.0.0:")+optarg;
             break;
         }
+        case 's':
+        {
+            staged = true;
+            cout << "staged reads" << endl;
+            break;
+        }
+        case 'c':
+        {
+            istringstream iss(optarg);
+            iss >> chunk_size;
+            chunk_size = (chunk_size + kDirectIoAlign - 1) / kDirectIoAlign * kDirectIoAlign;
+            if(!chunk_size) {
+                cerr << "staging chunk size must be at least 1" << endl;
+                return 1;
+            }
+            cout << "staging chunk size: " << chunk_size << endl;
+            break;
+        }
+        case 'q':
+        {
+            istringstream iss(optarg);
+            iss >> depth;
+            if(!depth) {
+                cerr << "staging depth must be at least 1" << endl;
+                return 1;
+            }
+            cout << "staging depth: " << depth << endl;
+            break;
+        }
+        case 'w':
+        {
+            windows = true;
+            cout << "memory windows" << endl;
+            break;
+        }
         case '?':
             return 1;
         default:
@@ -53,6 +380,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if(windows) {
+        serve_windows(connect_str, device, ib_port, pkey_index);
+        return 0;
+    }
+
     ib::Conn<> conn(ib::LISTENER, connect_str, device, ib_port, pkey_index);
     cout << "waiting for connection @ " << conn.connect_str << endl;
     conn.WaitConnected();
@@ -63,20 +395,17 @@ int main(int argc, char *argv[]) {
     }
     cout << "request file: " << req.filepath << endl;
 
-    auto file_mr = ib::make_file_mr(conn.pd, req.filepath);
-    FileResponse res;
-    res.addr = reinterpret_cast<uint64_t>(file_mr->addr);
-    res.key = file_mr->rkey;
-    res.size = file_mr->length;
-    if(!conn.cm_conn.PutMsg(res)) {
-        throw std::runtime_error("cannot send file response");
-    }
-
-    FileDone done;
-    if(!conn.cm_conn.GetMsg(&done)) {
-        cout << "file transfer error" << endl;
+    ib::MrPtr file_mr;
+    if(staged && !req.block_size && !req.offset && !req.length) {
+        serve_staged(conn, req.filepath, chunk_size, depth);
     }
     else {
-        cout << "file transfer success" << endl;
+        file_mr = ib::make_file_mr(conn.pd, req.filepath);
+        uint64_t offset, length;
+        request_range(req, file_mr->length, &offset, &length);
+        send_response(conn, req, reinterpret_cast<const char*>(file_mr->addr) + offset,
+            length, file_mr->rkey);
     }
+
+    wait_done(conn);
 }
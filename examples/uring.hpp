@@ -0,0 +1,152 @@
+#ifndef URING_HPP_
+#define URING_HPP_
+
+#include <stdexcept>
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+// minimal io_uring wrapper on the raw syscalls, one submitter and one reaper
+class Uring {
+public:
+    Uring(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+        if(fd_ < 0) {
+            throw std::runtime_error("cannot setup io_uring");
+        }
+
+        sq_ring_size_ = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+        cq_ring_size_ = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+        if(params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+        }
+        sq_ring_ = mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+        if(sq_ring_ == MAP_FAILED) {
+            close(fd_);
+            throw std::runtime_error("cannot mmap io_uring sq");
+        }
+        if(params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ring_ = sq_ring_;
+        }
+        else {
+            cq_ring_ = mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if(cq_ring_ == MAP_FAILED) {
+                munmap(sq_ring_, sq_ring_size_);
+                close(fd_);
+                throw std::runtime_error("cannot mmap io_uring cq");
+            }
+        }
+        sqes_size_ = params.sq_entries*sizeof(io_uring_sqe);
+        sqes_ = reinterpret_cast<io_uring_sqe*>(mmap(nullptr, sqes_size_,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+        if(sqes_ == MAP_FAILED) {
+            unmapRings();
+            close(fd_);
+            throw std::runtime_error("cannot mmap io_uring sqes");
+        }
+
+        auto sq = reinterpret_cast<char*>(sq_ring_);
+        sq_head_ = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail_ = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        sq_array_ = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        auto cq = reinterpret_cast<char*>(cq_ring_);
+        cq_head_ = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    }
+
+    Uring(const Uring&) = delete;
+
+    ~Uring() {
+        munmap(sqes_, sqes_size_);
+        unmapRings();
+        close(fd_);
+    }
+
+    void PrepRead(int fd, void *buf, unsigned len, uint64_t offset, uint64_t user_data) {
+        unsigned tail = *sq_tail_;
+        if(tail - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+            throw std::runtime_error("io_uring sq full");
+        }
+        unsigned index = tail & sq_mask_;
+        io_uring_sqe *sqe = &sqes_[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = reinterpret_cast<uint64_t>(buf);
+        sqe->len = len;
+        sqe->off = offset;
+        sqe->user_data = user_data;
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        ++to_submit_;
+    }
+
+    void Submit() {
+        while(to_submit_) {
+            int n = syscall(__NR_io_uring_enter, fd_, to_submit_, 0, 0, nullptr, 0);
+            if(n < 0) {
+                if(errno == EINTR || errno == EAGAIN) {
+                    continue;
+                }
+                throw std::runtime_error("cannot submit io_uring requests");
+            }
+            to_submit_ -= n;
+        }
+    }
+
+    io_uring_cqe Wait() {
+        while(true) {
+            unsigned head = *cq_head_;
+            if(head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+                io_uring_cqe cqe = cqes_[head & cq_mask_];
+                __atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+                return cqe;
+            }
+            int n = syscall(__NR_io_uring_enter, fd_, 0, 1, IORING_ENTER_GETEVENTS,
+                nullptr, 0);
+            if(n < 0 && errno != EINTR) {
+                throw std::runtime_error("cannot wait io_uring completion");
+            }
+        }
+    }
+
+private:
+    void unmapRings() {
+        if(cq_ring_ != sq_ring_ && cq_ring_ != MAP_FAILED) {
+            munmap(cq_ring_, cq_ring_size_);
+        }
+        munmap(sq_ring_, sq_ring_size_);
+    }
+
+    int fd_;
+    void *sq_ring_;
+    void *cq_ring_ = MAP_FAILED;
+    size_t sq_ring_size_;
+    size_t cq_ring_size_;
+    io_uring_sqe *sqes_;
+    size_t sqes_size_;
+    unsigned *sq_head_;
+    unsigned *sq_tail_;
+    unsigned sq_mask_;
+    unsigned sq_entries_;
+    unsigned *sq_array_;
+    unsigned *cq_head_;
+    unsigned *cq_tail_;
+    unsigned cq_mask_;
+    io_uring_cqe *cqes_;
+    unsigned to_submit_ = 0;
+};
+
+#endif
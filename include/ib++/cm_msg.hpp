@@ -9,6 +9,17 @@ struct ConnInfo {
     uint32_t psn;
 };
 
+// port of the listener's qp recovery channel, sent once during connection setup
+struct RecoveryEndpoint {
+    uint16_t port;
+};
+
+// new qp info of a side that re-entered INIT, epoch counts recoveries
+struct RecoveryInfo {
+    uint32_t epoch;
+    ConnInfo conn_info;
+};
+
 } //cm
 } //ib
 
@@ -24,7 +24,6 @@ struct Socket {
     Socket(const Socket&) = delete;
 
     Socket(Socket&& o) {
-        this->~Socket();
         fd = o.fd;
         o.fd = -1;
     }
@@ -35,6 +34,7 @@ struct Socket {
             fd = o.fd;
             o.fd = -1;
         }
+        return *this;
     }
 
     ~Socket() {
@@ -54,6 +54,8 @@ struct Conn {
             return;
         }
 
+        int reuse = 1;
+        setsockopt(sock_.fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
         sockaddr addr;
         ConnectStringToSockaddr(connect_str,
             reinterpret_cast<sockaddr_in *>(&addr));
@@ -97,6 +99,11 @@ struct Conn {
         }
     }
 
+    // wakes up any thread blocked on this connection, for teardown
+    void Shutdown() {
+        ::shutdown(sock_.fd, SHUT_RDWR);
+    }
+
     ConnInfo XchgInfo(const ConnInfo& info) {
         if(!PutMsg(info)) {
             throw std::runtime_error("cannot send info to peer");
@@ -110,10 +117,20 @@ struct Conn {
 
     template<typename T=ConnInfo>
     bool GetMsg(T *msg) {
+        return GetMsgs(msg, 1);
+    }
+
+    template<typename T=ConnInfo>
+    bool PutMsg(T msg) {
+        return PutMsgs(&msg, 1);
+    }
+
+    template<typename T>
+    bool GetMsgs(T *msgs, size_t count) {
         size_t size_read = 0;
-        while(size_read < sizeof(T)) {
-            ssize_t n = read(sock_.fd, reinterpret_cast<char*>(msg)+size_read,
-                sizeof(T)-size_read);
+        while(size_read < sizeof(T)*count) {
+            ssize_t n = read(sock_.fd, reinterpret_cast<char*>(msgs)+size_read,
+                sizeof(T)*count-size_read);
             if(n <= 0) {
                 return false;
             }
@@ -122,12 +139,12 @@ struct Conn {
         return true;
     }
 
-    template<typename T=ConnInfo>
-    bool PutMsg(T msg) {
+    template<typename T>
+    bool PutMsgs(const T *msgs, size_t count) {
         size_t size_written = 0;
-        while(size_written < sizeof(T)) {
-            ssize_t n = write(sock_.fd, reinterpret_cast<char*>(&msg)+size_written,
-                sizeof(T)-size_written);
+        while(size_written < sizeof(T)*count) {
+            ssize_t n = write(sock_.fd, reinterpret_cast<const char*>(msgs)+size_written,
+                sizeof(T)*count-size_written);
             if(n <= 0) {
                 return false;
             }
@@ -4,12 +4,20 @@
 #include <thread>
 #include <future>
 #include <map>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <mutex>
+#include <condition_variable>
 #include <atomic>
+#include <sstream>
+#include <poll.h>
 #include <ib++/verbs.hpp>
 #include <ib++/utils.hpp>
 #include <ib++/conn_role.hpp>
 #include <ib++/cm_tcp.hpp>
 #include <ib++/cm_msg.hpp>
+#include <ib++/sched.hpp>
 
 namespace ib {
 
@@ -23,62 +31,169 @@ template<typename CM = typename cm::tcp::Conn>
 struct Conn {
     Conn(ConnRole role=LISTENER, std::string connect_str_in="0.0.0.0:0",
             int nth_device=0, int port=0, int pkey_index=0):
+        Conn(role, connect_str_in, make_pd(make_ctx(get_devices(), nth_device)),
+            port, pkey_index) {}
+
+    // shares pd_in and its device context with other connections, so memory
+    // registered once can be exposed on all of them
+    Conn(ConnRole role, std::string connect_str_in, PdPtr pd_in,
+            int port=0, int pkey_index=0):
         state(WAITING), role_(role),
-        devices(get_devices()), ctx(make_ctx(devices, nth_device)),
-        pd(make_pd(ctx)), cc(make_cc(ctx)), scq(make_cq(ctx, cc)), rcq(make_cq(ctx)),
+        devices(get_devices()), ctx(pd_in, pd_in->context),
+        pd(pd_in), cc(make_cc(ctx)), scq(make_cq(ctx, cc)), rcq(make_cq(ctx)),
         qp(make_qp(pd, scq, rcq)),
         cm_conn(role, connect_str_in),
         connect_str(cm_conn.connect_str),
+        max_retries(5), retry_backoff(100),
+        port_(port), pkey_index_(pkey_index),
         psn_(GenRnd<uint32_t>(0, 0xffffff)),
-        connect_future_(connect_promise_.get_future())
+        wr_id_(0), request_id_(0), max_inflight_(8),
+        timer_wake_(Scheduler::Clock::time_point::max()),
+        epoch_(0), recovering_(false), stopping_(false),
+        connect_future_(connect_promise_.get_future()),
+        peer_future_(peer_promise_.get_future())
     {
         enterInit(port, pkey_index);
 
-        if(role == LISTENER) {
-            std::thread([this]{
-                cm_conn.accept();
-                establishConnection();
-            }).detach();
+        connect_thread_ = std::thread([this]{
+            try {
+                if(role_ == LISTENER) {
+                    cm_conn.accept();
+                }
+                else {
+                    cm_conn.connect();
+                }
+            }
+            catch(...) {
+                peer_promise_.set_exception(std::current_exception());
+                connect_promise_.set_exception(std::current_exception());
+                return;
+            }
+            peer_promise_.set_value();
+            establishConnection();
+        });
+        event_thread_ = std::thread([this]{
+            handleEvents();
+        });
+        timer_thread_ = std::thread([this]{
+            handleTimer();
+        });
+    }
+
+    Conn(const Conn&) = delete;
+
+    ~Conn() {
+        {
+            // both cm sockets go down first, the connect thread may be blocked
+            // on either of them
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+            cm_conn.Shutdown();
+            if(recovery_cm_) {
+                recovery_cm_->Shutdown();
+            }
         }
-        else {
-            std::thread([this]{
-                cm_conn.connect();
-                establishConnection();
-            }).detach();
+        connect_thread_.join();
+        if(recovery_thread_.joinable()) {
+            recovery_thread_.join();
         }
-        std::thread([this]{
-            handleEvents();
-        }).detach();
+        event_thread_.join();
+        timer_cv_.notify_one();
+        timer_thread_.join();
     }
 
     void WaitConnected() {
         connect_future_.get();
     }
 
+    // returns once the tcp peer is there, before the qp handshake, a listener
+    // has given up its listening socket by then
+    void WaitPeer() {
+        peer_future_.get();
+    }
+
+    // returns false if the connection is not up within timeout
+    bool WaitConnected(std::chrono::milliseconds timeout) {
+        if(connect_future_.wait_for(timeout) != std::future_status::ready) {
+            return false;
+        }
+        connect_future_.get();
+        return true;
+    }
+
     std::future<bool> Read(MrPtr mr, uint64_t remote_addr, uint32_t remote_key, uint64_t size) {
-        ibv_sge sge;
-        sge.addr = reinterpret_cast<uintptr_t>(mr->addr);
-        sge.length = mr->length;
-        sge.lkey = mr->lkey;
+        return Read(mr, 0, remote_addr, remote_key, mr->length);
+    }
 
-        ibv_send_wr wr;
-        wr.wr_id = wr_id_++;
-        wr.next = nullptr;
-        wr.sg_list = &sge;
-        wr.num_sge = 1;
-        wr.opcode = IBV_WR_RDMA_READ;
-        wr.send_flags = IBV_SEND_SIGNALED;
-        wr.wr.rdma.remote_addr = remote_addr;
-        wr.wr.rdma.rkey = remote_key;
+    // the read is split into fragments that are scheduled against the other
+    // requests on this connection according to their traffic class
+    std::future<bool> Read(MrPtr mr, uint64_t offset, uint64_t remote_addr,
+            uint32_t remote_key, uint64_t size, size_t traffic_class=0) {
+        if(offset + size > mr->length) {
+            throw std::out_of_range("rdma read exceeds mr");
+        }
+        Request req;
+        req.mr = mr;
+        req.local_addr = reinterpret_cast<uintptr_t>(mr->addr) + offset;
+        req.lkey = mr->lkey;
+        req.opcode = IBV_WR_RDMA_READ;
+        req.remote_addr = remote_addr;
+        req.remote_key = remote_key;
+        req.remaining = size;
+        req.failed = false;
+        auto future = req.promise.get_future();
+        if(!size) {
+            req.promise.set_value(true);
+            return future;
+        }
 
-        ibv_send_wr *bad_wr;
-        if(0 != ibv_post_send(qp.get(), &wr, &bad_wr)) {
-            throw std::runtime_error("cannot post rdma read");
+        std::lock_guard<std::mutex> lock(mutex_);
+        checkUsable();
+        uint64_t request_id = request_id_++;
+        sched_.Push(traffic_class, request_id, size);
+        requests_.emplace(request_id, std::move(req));
+        dispatch();
+        return future;
+    }
+
+    // binds a type 2 window over [offset, offset+size) of mr, which must be
+    // registered with IBV_ACCESS_MW_BIND, mw->rkey then grants access to that range
+    std::future<bool> BindMw(MwPtr mw, MrPtr mr, uint64_t offset, uint64_t size,
+            int access=IBV_ACCESS_REMOTE_READ) {
+        if(offset + size > mr->length) {
+            throw std::out_of_range("mw exceeds mr");
         }
-        return promises_[wr.wr_id].get_future();
+        std::lock_guard<std::mutex> lock(mutex_);
+        checkUsable();
+        mw->rkey = ibv_inc_rkey(mw->rkey);
+        PendingWr pending = controlWr(mr, mw, IBV_WR_BIND_MW);
+        pending.bind_addr = reinterpret_cast<uintptr_t>(mr->addr) + offset;
+        pending.bind_length = size;
+        pending.mw_access = access;
+        return postControl(pending, mr, mw);
+    }
+
+    // revokes the rkey of the last BindMw on mw
+    std::future<bool> InvalidateMw(MwPtr mw) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        checkUsable();
+        return postControl(controlWr(nullptr, mw, IBV_WR_LOCAL_INV), nullptr, mw);
+    }
+
+    // weight is the share of the connection the class gets relative to the
+    // others while they are all busy, bytes_per_sec of 0 leaves it unlimited
+    void SetTrafficClass(size_t traffic_class, uint32_t weight, uint64_t bytes_per_sec=0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sched_.SetClass(traffic_class, weight, bytes_per_sec);
     }
 
-    ConnState state;
+    // largest single wr, smaller fragments let other classes interleave sooner
+    void SetMaxFragment(uint64_t max_fragment) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        sched_.SetMaxFragment(max_fragment);
+    }
+
+    std::atomic<ConnState> state;
     DevicesPtr devices;
     CtxPtr ctx;
     PdPtr pd;
@@ -88,8 +203,177 @@ struct Conn {
     QpPtr qp;
     CM cm_conn;
     std::string connect_str;
+    // how many times a wr hit by a link failure is re-posted before its future
+    // yields false, other wr errors fail it right away
+    int max_retries;
+    // wait before the nth recovery of a wr is retry_backoff * 2^n
+    std::chrono::milliseconds retry_backoff;
 
 private:
+    struct Request {
+        MrPtr mr;
+        MwPtr mw;
+        uint64_t local_addr;
+        uint32_t lkey;
+        ibv_wr_opcode opcode;
+        uint64_t remote_addr;
+        uint32_t remote_key;
+        uint64_t remaining;
+        bool failed;
+        std::promise<bool> promise;
+    };
+
+    struct PendingWr {
+        uint64_t request_id;
+        // bytes of the request this wr completes, 1 for mw operations
+        uint64_t length;
+        ibv_sge sge;
+        ibv_wr_opcode opcode;
+        uint64_t remote_addr;
+        uint32_t remote_key;
+        ibv_mr *bind_mr;
+        // windows may exceed the 32 bit sge length
+        uint64_t bind_addr;
+        uint64_t bind_length;
+        ibv_mw *mw;
+        uint32_t mw_rkey;
+        int mw_access;
+        int retries;
+    };
+
+    // must hold mutex_
+    PendingWr controlWr(MrPtr mr, MwPtr mw, ibv_wr_opcode opcode) {
+        PendingWr pending;
+        memset(&pending, 0, sizeof(pending));
+        pending.length = 1;
+        pending.opcode = opcode;
+        pending.bind_mr = mr.get();
+        pending.mw = mw.get();
+        pending.mw_rkey = mw->rkey;
+        return pending;
+    }
+
+    // mw operations bypass the scheduler and go ahead of queued fragments,
+    // must hold mutex_
+    std::future<bool> postControl(PendingWr pending, MrPtr mr, MwPtr mw) {
+        Request req;
+        req.mr = mr;
+        req.mw = mw;
+        req.remaining = pending.length;
+        req.failed = false;
+        auto future = req.promise.get_future();
+        pending.request_id = request_id_++;
+        requests_.emplace(pending.request_id, std::move(req));
+        control_queue_.push_back(pending);
+        dispatch();
+        return future;
+    }
+
+    // posts scheduled fragments while the send queue has room, must hold mutex_
+    void dispatch() {
+        if(recovering_ || state == ERROR) {
+            return;
+        }
+        while(pending_.size() < max_inflight_ && !control_queue_.empty()) {
+            auto pending = control_queue_.front();
+            control_queue_.pop_front();
+            uint64_t wr_id = wr_id_++;
+            if(!postWr(wr_id, pending)) {
+                completeFragment(pending, false);
+                continue;
+            }
+            pending_.emplace(wr_id, pending);
+        }
+
+        Fragment frag;
+        Scheduler::Clock::time_point wake = Scheduler::Clock::time_point::max();
+        while(pending_.size() < max_inflight_ &&
+                sched_.Pop(Scheduler::Clock::now(), &frag, &wake)) {
+            auto& req = requests_.at(frag.id);
+            PendingWr pending;
+            memset(&pending, 0, sizeof(pending));
+            pending.request_id = frag.id;
+            pending.length = frag.length;
+            pending.sge.addr = req.local_addr + frag.offset;
+            pending.sge.length = frag.length;
+            pending.sge.lkey = req.lkey;
+            pending.opcode = req.opcode;
+            pending.remote_addr = req.remote_addr + frag.offset;
+            pending.remote_key = req.remote_key;
+            pending.retries = 0;
+
+            uint64_t wr_id = wr_id_++;
+            if(!postWr(wr_id, pending)) {
+                completeFragment(pending, false);
+                continue;
+            }
+            pending_.emplace(wr_id, pending);
+        }
+        if(pending_.size() < max_inflight_ && wake < timer_wake_) {
+            timer_wake_ = wake;
+            timer_cv_.notify_one();
+        }
+    }
+
+    // must hold mutex_
+    void completeFragment(const PendingWr& pending, bool success) {
+        auto iter = requests_.find(pending.request_id);
+        if(iter == requests_.end()) {
+            return;
+        }
+        iter->second.failed |= !success;
+        iter->second.remaining -= pending.length;
+        if(!iter->second.remaining) {
+            iter->second.promise.set_value(!iter->second.failed);
+            requests_.erase(iter);
+        }
+    }
+
+    // wakes the dispatcher once a rate limited class has tokens again
+    void handleTimer() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while(!stopping_) {
+            auto now = Scheduler::Clock::now();
+            if(now >= timer_wake_) {
+                timer_wake_ = Scheduler::Clock::time_point::max();
+                dispatch();
+                continue;
+            }
+            timer_cv_.wait_until(lock, std::min(timer_wake_, now + std::chrono::milliseconds(100)));
+        }
+    }
+
+    bool postWr(uint64_t wr_id, PendingWr& pending) {
+        ibv_send_wr wr;
+        memset(&wr, 0, sizeof(wr));
+        wr.wr_id = wr_id;
+        wr.next = nullptr;
+        wr.opcode = pending.opcode;
+        wr.send_flags = IBV_SEND_SIGNALED;
+        switch(pending.opcode) {
+        case IBV_WR_BIND_MW:
+            wr.bind_mw.mw = pending.mw;
+            wr.bind_mw.rkey = pending.mw_rkey;
+            wr.bind_mw.bind_info.mr = pending.bind_mr;
+            wr.bind_mw.bind_info.addr = pending.bind_addr;
+            wr.bind_mw.bind_info.length = pending.bind_length;
+            wr.bind_mw.bind_info.mw_access_flags = pending.mw_access;
+            break;
+        case IBV_WR_LOCAL_INV:
+            wr.invalidate_rkey = pending.mw_rkey;
+            break;
+        default:
+            wr.sg_list = &pending.sge;
+            wr.num_sge = 1;
+            wr.wr.rdma.remote_addr = pending.remote_addr;
+            wr.wr.rdma.rkey = pending.remote_key;
+            break;
+        }
+
+        ibv_send_wr *bad_wr;
+        return 0 == ibv_post_send(qp.get(), &wr, &bad_wr);
+    }
+
     void enterInit(int port, int pkey_index) {
         ibv_qp_attr qp_attr;
         memset(&qp_attr, 0, sizeof(qp_attr));
@@ -104,6 +388,15 @@ private:
         }
     }
 
+    void enterReset() {
+        ibv_qp_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.qp_state = IBV_QPS_RESET;
+        if(0 != ibv_modify_qp(qp.get(), &attr, IBV_QP_STATE)) {
+            throw std::runtime_error("cannot reset qp");
+        }
+    }
+
     uint16_t getLid() {
         ibv_port_attr attr;
         if(0 != ibv_query_port(ctx.get(), 1, &attr)) {
@@ -153,8 +446,13 @@ private:
         try {
             cm::ConnInfo local_info{getLid(), qp->qp_num, psn_};
             auto remote_info = cm_conn.XchgInfo(local_info);
+            establishRecoveryChannel();
             enterRtr(remote_info);
             enterRts();
+            recovery_thread_ = std::thread([this]{
+                handleRecovery();
+            });
+            state = CONNECTED;
             connect_promise_.set_value();
         }
         catch(...) {
@@ -162,11 +460,199 @@ private:
         }
     }
 
+    // a second cm connection dedicated to qp recovery, so it never interleaves
+    // with the messages the application exchanges over cm_conn
+    void establishRecoveryChannel() {
+        if(role_ == LISTENER) {
+            auto& recovery_cm = installRecoveryCm(
+                std::unique_ptr<CM>(new CM(LISTENER, "0.0.0.0:0")));
+            auto idx = recovery_cm.connect_str.rfind(":");
+            std::istringstream iss(recovery_cm.connect_str.substr(idx + 1));
+            cm::RecoveryEndpoint endpoint;
+            iss >> endpoint.port;
+            if(!cm_conn.PutMsg(endpoint)) {
+                throw std::runtime_error("cannot send recovery endpoint");
+            }
+            recovery_cm.accept();
+        }
+        else {
+            cm::RecoveryEndpoint endpoint;
+            if(!cm_conn.GetMsg(&endpoint)) {
+                throw std::runtime_error("cannot get recovery endpoint");
+            }
+            std::ostringstream oss;
+            oss << connect_str.substr(0, connect_str.rfind(":")) << ":" << endpoint.port;
+            installRecoveryCm(std::unique_ptr<CM>(new CM(CONNECTOR, oss.str()))).connect();
+        }
+    }
+
+    // publishes the recovery cm so the destructor can shut it down, unless
+    // the connection is already being torn down
+    CM& installRecoveryCm(std::unique_ptr<CM> recovery_cm) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if(stopping_) {
+            throw std::runtime_error("connection closed");
+        }
+        recovery_cm_ = std::move(recovery_cm);
+        return *recovery_cm_;
+    }
+
+    // cycles the qp back to INIT with a fresh psn and sends the new info to
+    // the peer, must hold mutex_
+    void restartQp() {
+        recovering_ = true;
+        enterReset();
+        enterInit(port_, pkey_index_);
+        psn_ = GenRnd<uint32_t>(0, 0xffffff);
+    }
+
+    void sendRecoveryInfo() {
+        cm::RecoveryInfo info{epoch_, cm::ConnInfo{getLid(), qp->qp_num, psn_}};
+        if(!recovery_cm_->PutMsg(info)) {
+            throw std::runtime_error("cannot send recovery info");
+        }
+    }
+
+    // must hold mutex_
+    void startRecovery() {
+        try {
+            ++epoch_;
+            restartQp();
+            sendRecoveryInfo();
+        }
+        catch(...) {
+            failPending();
+        }
+    }
+
+    void handleRecovery() {
+        while(true) {
+            cm::RecoveryInfo info;
+            if(!recovery_cm_->GetMsg(&info)) {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if(recovering_) {
+                    failPending();
+                }
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if(state == ERROR || info.epoch < epoch_ ||
+                    (info.epoch == epoch_ && !recovering_)) {
+                continue;
+            }
+            try {
+                if(info.epoch > epoch_) {
+                    // the peer hit the error, follow it into the new epoch
+                    epoch_ = info.epoch;
+                    restartQp();
+                    enterRtr(info.conn_info);
+                    sendRecoveryInfo();
+                }
+                else {
+                    enterRtr(info.conn_info);
+                }
+                enterRts();
+                recovering_ = false;
+                repostPending();
+            }
+            catch(...) {
+                failPending();
+            }
+        }
+    }
+
+    // old wr ids may still show up as flushed completions, so everything
+    // is re-posted under fresh ids, must hold mutex_
+    void repostPending() {
+        std::map<uint64_t, PendingWr> pending;
+        pending.swap(pending_);
+        for(auto& entry: pending) {
+            uint64_t wr_id = wr_id_++;
+            if(!postWr(wr_id, entry.second)) {
+                completeFragment(entry.second, false);
+                continue;
+            }
+            pending_.emplace(wr_id, entry.second);
+        }
+        dispatch();
+    }
+
+    // the qp is given up, resolves every request whether it was posted or
+    // still queued, must hold mutex_
+    void failPending() {
+        for(auto& entry: requests_) {
+            entry.second.promise.set_value(false);
+        }
+        requests_.clear();
+        pending_.clear();
+        control_queue_.clear();
+        sched_.Clear();
+        recovering_ = false;
+        state = ERROR;
+    }
+
+    // must hold mutex_
+    void checkUsable() {
+        if(state == ERROR) {
+            throw std::runtime_error("connection failed");
+        }
+    }
+
+    // link level failures that a fresh qp can get past, anything else is a
+    // problem with the wr itself and would fail the same way again
+    static bool isTransient(ibv_wc_status status) {
+        return status == IBV_WC_RETRY_EXC_ERR || status == IBV_WC_RNR_RETRY_EXC_ERR ||
+            status == IBV_WC_WR_FLUSH_ERR;
+    }
+
+    // returns true if the qp needs recovery, after waiting *backoff
+    bool handleCompletion(const ibv_wc& wc, uint32_t *epoch,
+            std::chrono::milliseconds *backoff) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto iter = pending_.find(wc.wr_id);
+        if(iter == pending_.end()) {
+            return false;
+        }
+        if(wc.status == IBV_WC_SUCCESS) {
+            completeFragment(iter->second, true);
+            pending_.erase(iter);
+            dispatch();
+            return false;
+        }
+        if(recovering_) {
+            return false;
+        }
+
+        // the qp is in the error state either way, only the wr's fate differs
+        *backoff = std::chrono::milliseconds(0);
+        int retries = iter->second.retries++;
+        if(!isTransient(wc.status) || retries >= max_retries) {
+            completeFragment(iter->second, false);
+            pending_.erase(iter);
+        }
+        else {
+            *backoff = retry_backoff * (1 << retries);
+        }
+        recovering_ = true;
+        *epoch = epoch_;
+        return true;
+    }
+
     void handleEvents() {
         if(0 != ibv_req_notify_cq(scq.get(), 0)) {
             throw std::runtime_error("cannot request cq notification");
         }
-        while(true) {
+        while(!stopping_) {
+            pollfd pfd{cc->fd, POLLIN, 0};
+            int ready = poll(&pfd, 1, 100);
+            if(ready < 0 && errno != EINTR) {
+                throw std::runtime_error("cannot poll completion channel");
+            }
+            if(ready <= 0) {
+                continue;
+            }
+
             ibv_cq *cq;
             void *cq_ctx;
             if(0 != ibv_get_cq_event(cc.get(), &cq, &cq_ctx)) {
@@ -188,19 +674,48 @@ private:
                     continue;
                 }
                 else {
-                    promises_[wc.wr_id].set_value(wc.status == IBV_WC_SUCCESS);
-                    promises_.erase(wc.wr_id);
+                    uint32_t epoch;
+                    std::chrono::milliseconds backoff;
+                    if(handleCompletion(wc, &epoch, &backoff)) {
+                        // give a flapping link time to settle, the peer may
+                        // start the recovery in the meantime
+                        std::this_thread::sleep_for(backoff);
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        if(epoch == epoch_ && recovering_) {
+                            startRecovery();
+                        }
+                    }
                 }
             } while(n);
         }
     }
 
     ConnRole role_;
+    int port_;
+    int pkey_index_;
     uint32_t psn_;
-    std::map<uint64_t, std::promise<bool>> promises_;
-    std::atomic_uint_fast64_t wr_id_;
+    std::mutex mutex_;
+    std::map<uint64_t, Request> requests_;
+    std::map<uint64_t, PendingWr> pending_;
+    std::deque<PendingWr> control_queue_;
+    uint64_t wr_id_;
+    uint64_t request_id_;
+    Scheduler sched_;
+    size_t max_inflight_;
+    Scheduler::Clock::time_point timer_wake_;
+    std::condition_variable timer_cv_;
+    uint32_t epoch_;
+    bool recovering_;
+    std::atomic_bool stopping_;
+    std::unique_ptr<CM> recovery_cm_;
     std::promise<void> connect_promise_;
-    std::future<void> connect_future_;
+    std::shared_future<void> connect_future_;
+    std::promise<void> peer_promise_;
+    std::shared_future<void> peer_future_;
+    std::thread connect_thread_;
+    std::thread event_thread_;
+    std::thread recovery_thread_;
+    std::thread timer_thread_;
 };
 
 } //ib
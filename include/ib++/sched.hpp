@@ -0,0 +1,165 @@
+#ifndef IB_SCHED_HPP_
+#define IB_SCHED_HPP_
+
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <algorithm>
+#include <stdexcept>
+
+namespace ib {
+
+struct Fragment {
+    size_t cls;
+    uint64_t id;
+    uint64_t offset;
+    uint64_t length;
+};
+
+// splits requests into fragments and hands them out by deficit round robin
+// across traffic classes, each class optionally capped by a token bucket,
+// requests within a class take turns fragment by fragment
+class Scheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    Scheduler(size_t num_classes=4, uint64_t max_fragment=1<<20):
+        classes_(num_classes), max_fragment_(max_fragment), current_(0), turn_open_(false) {}
+
+    // bytes_per_sec of 0 leaves the class unlimited
+    void SetClass(size_t cls, uint32_t weight, uint64_t bytes_per_sec=0) {
+        auto& c = getClass(cls);
+        c.weight = std::max<uint32_t>(weight, 1);
+        c.bytes_per_sec = bytes_per_sec;
+        c.tokens = burst(c);
+        c.last_refill = Clock::now();
+    }
+
+    void SetMaxFragment(uint64_t max_fragment) {
+        max_fragment_ = std::max<uint64_t>(max_fragment, 1);
+    }
+
+    void Push(size_t cls, uint64_t id, uint64_t size) {
+        if(size) {
+            getClass(cls).queue.push_back(Request{id, 0, size});
+        }
+    }
+
+    // drops every queued request
+    void Clear() {
+        for(auto& c: classes_) {
+            c.queue.clear();
+            c.deficit = 0;
+        }
+        turn_open_ = false;
+    }
+
+    // if nothing is eligible and a rate limit is holding work back, *wake is
+    // set to when that class will have tokens again
+    bool Pop(Clock::time_point now, Fragment *frag, Clock::time_point *wake) {
+        *wake = Clock::time_point::max();
+        for(auto& c: classes_) {
+            refill(c, now);
+        }
+        size_t ended = 0;
+        while(ended <= classes_.size()) {
+            auto& c = classes_[current_];
+            if(c.queue.empty()) {
+                c.deficit = 0;
+                endTurn();
+                ++ended;
+                continue;
+            }
+
+            auto& req = c.queue.front();
+            uint64_t length = std::min(max_fragment_, req.size - req.offset);
+            if(c.bytes_per_sec && c.tokens < length) {
+                auto wait = std::chrono::duration<double>((length - c.tokens) / c.bytes_per_sec);
+                // rounded up, waking early would find the bucket still short
+                auto ticks = std::chrono::duration_cast<Clock::duration>(wait) + Clock::duration(1);
+                *wake = std::min(*wake, now + ticks);
+                endTurn();
+                ++ended;
+                continue;
+            }
+            if(!turn_open_) {
+                c.deficit += c.weight * max_fragment_;
+                turn_open_ = true;
+            }
+            if(c.deficit < length) {
+                endTurn();
+                ++ended;
+                continue;
+            }
+
+            *frag = Fragment{current_, req.id, req.offset, length};
+            c.deficit -= length;
+            if(c.bytes_per_sec) {
+                c.tokens -= length;
+            }
+            req.offset += length;
+            if(req.offset == req.size) {
+                c.queue.pop_front();
+            }
+            else if(c.queue.size() > 1) {
+                // so a small request never waits behind all of a bulk one
+                Request rest = req;
+                c.queue.pop_front();
+                c.queue.push_back(rest);
+            }
+            return true;
+        }
+        return false;
+    }
+
+private:
+    struct Request {
+        uint64_t id;
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct Class {
+        uint32_t weight = 1;
+        uint64_t bytes_per_sec = 0;
+        double tokens = 0;
+        Clock::time_point last_refill;
+        uint64_t deficit = 0;
+        std::deque<Request> queue;
+    };
+
+    Class& getClass(size_t cls) {
+        if(cls >= classes_.size()) {
+            throw std::out_of_range("no such traffic class");
+        }
+        return classes_[cls];
+    }
+
+    // a rate limited class may burst one fragment or 10ms of its rate
+    double burst(const Class& c) {
+        return std::max<double>(max_fragment_, c.bytes_per_sec / 100.0);
+    }
+
+    void refill(Class& c, Clock::time_point now) {
+        if(!c.bytes_per_sec) {
+            return;
+        }
+        std::chrono::duration<double> elapsed = now - c.last_refill;
+        c.tokens = std::min(burst(c), c.tokens + elapsed.count() * c.bytes_per_sec);
+        c.last_refill = now;
+    }
+
+    void endTurn() {
+        current_ = (current_ + 1) % classes_.size();
+        turn_open_ = false;
+    }
+
+    std::vector<Class> classes_;
+    uint64_t max_fragment_;
+    size_t current_;
+    bool turn_open_;
+};
+
+} //ib
+
+#endif
@@ -53,7 +53,10 @@ static PdPtr make_pd(CtxPtr ctx) {
     if(!ptr) {
         throw std::runtime_error("cannot allocate pd");
     }
-    return PdPtr(ptr, ibv_dealloc_pd);
+    // the pd keeps its context open, so connections can share it
+    return PdPtr(ptr, [ctx](ibv_pd *ptr) {
+        ibv_dealloc_pd(ptr);
+    });
 }
 
 using CcPtr = std::shared_ptr<ibv_comp_channel>;
@@ -66,8 +69,8 @@ static CcPtr make_cc(CtxPtr ctx) {
 }
 
 using CqPtr = std::shared_ptr<ibv_cq>;
-static CqPtr make_cq(CtxPtr ctx, CcPtr cc=CcPtr(nullptr)) {
-    auto ptr = ibv_create_cq(ctx.get(), 1, nullptr, cc.get(), 0);
+static CqPtr make_cq(CtxPtr ctx, CcPtr cc=CcPtr(nullptr), int cqe=16) {
+    auto ptr = ibv_create_cq(ctx.get(), cqe, nullptr, cc.get(), 0);
     if(!ptr) {
         throw std::runtime_error("cannot create cq");
     }
@@ -110,6 +113,24 @@ static MrPtr make_mr(PdPtr pd, size_t size, int access=IBV_ACCESS_LOCAL_WRITE |
     });
 }
 
+static MrPtr make_aligned_mr(PdPtr pd, size_t size, size_t alignment,
+    int access=IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ |
+    IBV_ACCESS_REMOTE_ATOMIC) {
+    void *buf;
+    if(0 != posix_memalign(&buf, alignment, size)) {
+        throw std::runtime_error("cannot allocate aligned buffer");
+    }
+    auto ptr = ibv_reg_mr(pd.get(), buf, size, access);
+    if(!ptr) {
+        free(buf);
+        throw std::runtime_error("cannot create aligned mr");
+    }
+    return MrPtr(ptr, [](ibv_mr *ptr){
+        ibv_dereg_mr(ptr);
+        free(ptr->addr);
+    });
+}
+
 static MrPtr make_file_mr(PdPtr pd, const char *pathname, size_t size=-1,
     int access=IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ |
     IBV_ACCESS_REMOTE_ATOMIC) {
@@ -149,6 +170,29 @@ static MrPtr make_file_mr(PdPtr pd, const char *pathname, size_t size=-1,
     });
 }
 
+using MwPtr = std::shared_ptr<ibv_mw>;
+static MwPtr make_mw(PdPtr pd, ibv_mw_type type=IBV_MW_TYPE_2) {
+    auto ptr = ibv_alloc_mw(pd.get(), type);
+    if(!ptr) {
+        throw std::runtime_error("cannot allocate mw");
+    }
+    return MwPtr(ptr, [pd](ibv_mw *ptr) {
+        ibv_dealloc_mw(ptr);
+    });
+}
+
+// registers the memory of an existing mr in another pd, keeping it alive
+static MrPtr make_alias_mr(PdPtr pd, MrPtr mr, int access=IBV_ACCESS_LOCAL_WRITE |
+    IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_ATOMIC) {
+    auto ptr = ibv_reg_mr(pd.get(), mr->addr, mr->length, access);
+    if(!ptr) {
+        throw std::runtime_error("cannot create alias mr");
+    }
+    return MrPtr(ptr, [mr](ibv_mr *ptr) {
+        ibv_dereg_mr(ptr);
+    });
+}
+
 } //ib
 
 #endif
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include "block_hash.hpp"
+
+using namespace std;
+
+// unlike assert, never compiled out
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+        exit(1); \
+    } \
+} while(0)
+
+static vector<char> make_buf(size_t size) {
+    vector<char> buf(size);
+    for(size_t i=0; i<size; ++i) {
+        buf[i] = static_cast<char>(i * 131 + 7);
+    }
+    return buf;
+}
+
+static void test_tail_block() {
+    auto buf = make_buf(1000);
+    auto hashes = hash_blocks(buf.data(), buf.size(), 256, 3);
+    CHECK(hashes.size() == 4);
+    CHECK(hashes[3] == hash_block(buf.data() + 768, 232));
+    for(size_t i=0; i<3; ++i) {
+        CHECK(hashes[i] == hash_block(buf.data() + i*256, 256));
+    }
+    // same bytes, different length
+    CHECK(hash_block(buf.data(), 16) != hash_block(buf.data(), 17));
+}
+
+static void test_empty_file() {
+    auto hashes = hash_blocks(nullptr, 0, 256);
+    CHECK(hashes.empty());
+    CHECK(diff_blocks(hashes, hashes, 0, 256).empty());
+    CHECK(complement_ranges(vector<Range>(), 0).empty());
+}
+
+static void test_diff_merges_adjacent() {
+    auto local_buf = make_buf(1000);
+    auto remote_buf = local_buf;
+    remote_buf[300] ^= 1;
+    remote_buf[600] ^= 1;
+    remote_buf[999] ^= 1;
+    auto local = hash_blocks(local_buf.data(), local_buf.size(), 256);
+    auto remote = hash_blocks(remote_buf.data(), remote_buf.size(), 256);
+
+    // blocks 1, 2 and the tail block 3 differ and merge into one range
+    auto ranges = diff_blocks(local, remote, remote_buf.size(), 256);
+    CHECK(ranges.size() == 1);
+    CHECK(ranges[0] == Range(256, 744));
+
+    remote_buf = local_buf;
+    remote_buf[0] ^= 1;
+    remote_buf[600] ^= 1;
+    remote = hash_blocks(remote_buf.data(), remote_buf.size(), 256);
+    ranges = diff_blocks(local, remote, remote_buf.size(), 256);
+    CHECK(ranges.size() == 2);
+    CHECK(ranges[0] == Range(0, 256));
+    CHECK(ranges[1] == Range(512, 256));
+}
+
+static void test_diff_longer_remote() {
+    auto buf = make_buf(1000);
+    auto local = hash_blocks(buf.data(), 512, 256);
+    auto remote = hash_blocks(buf.data(), buf.size(), 256);
+    auto ranges = diff_blocks(local, remote, buf.size(), 256);
+    CHECK(ranges.size() == 1);
+    CHECK(ranges[0] == Range(512, 488));
+}
+
+static void test_complement_coverage() {
+    vector<Range> ranges{Range(0, 10), Range(20, 5), Range(40, 60)};
+    auto rest = complement_ranges(ranges, 100);
+    CHECK(rest.size() == 2);
+    CHECK(rest[0] == Range(10, 10));
+    CHECK(rest[1] == Range(25, 15));
+
+    // ranges and complement tile [0, size) exactly once
+    vector<int> covered(100, 0);
+    for(auto& r: ranges) {
+        for(uint64_t i=r.first; i<r.first+r.second; ++i) {
+            ++covered[i];
+        }
+    }
+    for(auto& r: rest) {
+        for(uint64_t i=r.first; i<r.first+r.second; ++i) {
+            ++covered[i];
+        }
+    }
+    for(auto c: covered) {
+        CHECK(c == 1);
+    }
+
+    CHECK(complement_ranges(vector<Range>(), 100) == vector<Range>{Range(0, 100)});
+    CHECK(complement_ranges(vector<Range>{Range(0, 100)}, 100).empty());
+    CHECK(complement_ranges(vector<Range>{Range(50, 10)}, 60) ==
+        vector<Range>{Range(0, 50)});
+}
+
+int main() {
+    test_tail_block();
+    test_empty_file();
+    test_diff_merges_adjacent();
+    test_diff_longer_remote();
+    test_complement_coverage();
+    cout << "block_hash_test passed" << endl;
+}
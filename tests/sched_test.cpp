@@ -0,0 +1,95 @@
+#include <iostream>
+#include <cstdint>
+#include <cstdlib>
+#include <ib++/sched.hpp>
+
+using namespace std;
+using ib::Scheduler;
+using ib::Fragment;
+
+// unlike assert, never compiled out, the checked calls drive the scheduler
+#define CHECK(cond) do { \
+    if(!(cond)) { \
+        cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #cond << endl; \
+        exit(1); \
+    } \
+} while(0)
+
+static void test_weighted_shares() {
+    Scheduler sched(2, 100);
+    sched.SetClass(0, 3);
+    sched.SetClass(1, 1);
+    sched.Push(0, 1, 100000);
+    sched.Push(1, 2, 100000);
+
+    Fragment frag;
+    Scheduler::Clock::time_point wake;
+    auto now = Scheduler::Clock::now();
+    int served[2] = {0, 0};
+    for(int i=0; i<400; ++i) {
+        CHECK(sched.Pop(now, &frag, &wake));
+        CHECK(frag.length == 100);
+        ++served[frag.cls];
+    }
+    CHECK(served[0] == 300);
+    CHECK(served[1] == 100);
+}
+
+static void test_interleave_within_class() {
+    Scheduler sched(1, 100);
+    sched.Push(0, 1, 1000000);
+
+    Fragment frag;
+    Scheduler::Clock::time_point wake;
+    auto now = Scheduler::Clock::now();
+    CHECK(sched.Pop(now, &frag, &wake));
+    CHECK(frag.id == 1);
+
+    sched.Push(0, 2, 50);
+    bool small_served = false;
+    for(int i=0; i<2 && !small_served; ++i) {
+        CHECK(sched.Pop(now, &frag, &wake));
+        small_served = frag.id == 2;
+    }
+    CHECK(small_served);
+    CHECK(frag.offset == 0 && frag.length == 50);
+}
+
+static void test_rate_limit_wake() {
+    Scheduler sched(1, 100);
+    sched.SetClass(0, 1, 1000);
+    auto now = Scheduler::Clock::now();
+    sched.Push(0, 1, 1000);
+
+    Fragment frag;
+    Scheduler::Clock::time_point wake;
+    // the bucket starts with one fragment worth of tokens
+    CHECK(sched.Pop(now, &frag, &wake));
+    CHECK(!sched.Pop(now, &frag, &wake));
+    auto wait = chrono::duration_cast<chrono::milliseconds>(wake - now).count();
+    CHECK(wait >= 99 && wait <= 100);
+
+    CHECK(sched.Pop(wake, &frag, &wake));
+    CHECK(frag.offset == 100);
+}
+
+static void test_idle_and_clear() {
+    Scheduler sched(2, 100);
+    Fragment frag;
+    Scheduler::Clock::time_point wake;
+    auto now = Scheduler::Clock::now();
+    CHECK(!sched.Pop(now, &frag, &wake));
+    CHECK(wake == Scheduler::Clock::time_point::max());
+
+    sched.Push(1, 1, 1000);
+    sched.Clear();
+    CHECK(!sched.Pop(now, &frag, &wake));
+}
+
+int main() {
+    test_weighted_shares();
+    test_interleave_within_class();
+    test_rate_limit_wake();
+    test_idle_and_clear();
+    cout << "sched_test passed" << endl;
+}